@@ -1,96 +1,678 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, MAP_HUGETLB
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // ADDED FOR memcpy
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "functions.h"
 #define MAX_LINE_LENGTH 1024 // Define maximum line length for reading
 
-void ReadMMtoCSR(const char *filename, CSRMatrix *matrix)
+#define CHUNK_SIZE (1 << 20)  // Bytes of decompressed text handed to a parser at a time
+#define RAW_BUFFER_SIZE (1 << 16) // Bytes of compressed input read per fread
+#define MAX_PARSE_THREADS 8
+
+enum { FORMAT_PLAIN, FORMAT_GZIP, FORMAT_ZSTD };
+
+// Compressed or plain input stream; only reads forward so pipes and stdin work
+typedef struct {
+    FILE *file;
+    int format;
+    unsigned char *raw; // Raw bytes read from file, not yet consumed
+    size_t raw_len;
+    size_t raw_pos;
+    int file_eof;
+    int done;
+    int frame_open; // Inside a compressed frame, so running out of input means truncation
+    int member_ended; // A gzip member just ended; what follows is another member or trailing padding
+    z_stream gz;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zs;
+#endif
+} InputSource;
+
+static size_t source_fill_raw(InputSource *src)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
+    src->raw_len = fread(src->raw, 1, RAW_BUFFER_SIZE, src->file);
+    src->raw_pos = 0;
+    if (src->raw_len == 0)
+        src->file_eof = 1;
+    return src->raw_len;
+}
+
+// Detects the format from the magic bytes without seeking, the peeked bytes stay in src->raw
+static int source_open(InputSource *src, FILE *file)
+{
+    memset(src, 0, sizeof(*src));
+    src->file = file;
+    src->raw = (unsigned char *)malloc(RAW_BUFFER_SIZE);
+    if (src->raw == NULL)
     {
-        fprintf(stderr, "Failed to open file %s\n", filename); // handling input error
-        return;
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return 0;
     }
 
-    char line[1500];
+    while (src->raw_len < 4 && !src->file_eof) // a pipe may deliver fewer bytes than asked
+    {
+        size_t n = fread(src->raw + src->raw_len, 1, RAW_BUFFER_SIZE - src->raw_len, file);
+        if (n == 0)
+            src->file_eof = 1;
+        src->raw_len += n;
+    }
 
-    while (fgets(line, sizeof(line), file))
+    const unsigned char *m = src->raw;
+    if (src->raw_len >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+    {
+        src->format = FORMAT_GZIP;
+        if (inflateInit2(&src->gz, 15 + 32) != Z_OK) // 15 + 32: zlib or gzip header, detected automatically
+        {
+            fprintf(stderr, "Failed to initialize gzip decompression.\n");
+            return 0;
+        }
+    }
+    else if (src->raw_len >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+    {
+        src->format = FORMAT_ZSTD;
+#ifdef HAVE_ZSTD
+        src->zs = ZSTD_createDStream();
+        if (src->zs == NULL || ZSTD_isError(ZSTD_initDStream(src->zs)))
+        {
+            fprintf(stderr, "Failed to initialize zstd decompression.\n");
+            return 0;
+        }
+#else
+        fprintf(stderr, "Input is zstd-compressed; rebuild with ZSTD=1 to read it.\n");
+        return 0;
+#endif
+    }
+    else
     {
-        if (line[0] != '%')
-            break; // skipping lines that start with % (comments)
+        src->format = FORMAT_PLAIN;
     }
+    return 1;
+}
+
+static void source_close(InputSource *src)
+{
+    if (src->format == FORMAT_GZIP)
+        inflateEnd(&src->gz);
+#ifdef HAVE_ZSTD
+    if (src->zs != NULL)
+        ZSTD_freeDStream(src->zs);
+#endif
+    free(src->raw);
+}
 
-    sscanf(line, "%d %d %d", &matrix->num_rows, &matrix->num_cols, &matrix->num_non_zeros); // reading matrix dimensions and # of nonzero elements
+// Reads up to cap decompressed bytes into dst. Returns bytes read, 0 at end of input, -1 on error
+static long source_read(InputSource *src, char *dst, size_t cap)
+{
+    while (!src->done)
+    {
+        if (src->raw_pos == src->raw_len && !src->file_eof)
+            source_fill_raw(src);
 
-    matrix->csr_data = (double *)malloc(matrix->num_non_zeros * sizeof(double));
-    matrix->col_ind = (int *)malloc(matrix->num_non_zeros * sizeof(int));
-    matrix->row_ptr = (int *)calloc(matrix->num_rows + 1, sizeof(int));
+        if (src->format == FORMAT_PLAIN)
+        {
+            if (src->raw_pos == src->raw_len)
+            {
+                src->done = 1;
+                break;
+            }
+            size_t n = src->raw_len - src->raw_pos < cap ? src->raw_len - src->raw_pos : cap;
+            memcpy(dst, src->raw + src->raw_pos, n);
+            src->raw_pos += n;
+            return (long)n;
+        }
 
-    if (matrix->csr_data == NULL || matrix->col_ind == NULL || matrix->row_ptr == NULL) // incase memory allocation was failed
+        size_t produced = 0;
+        if (src->format == FORMAT_GZIP)
+        {
+            if (src->member_ended)
+            {
+                // Another member must start with the gzip magic; anything else (e.g. zero padding
+                // from tape or block devices) ends the stream, as it does for gzip itself
+                if (src->raw_len - src->raw_pos < 2 && !src->file_eof)
+                {
+                    size_t left = src->raw_len - src->raw_pos;
+                    memmove(src->raw, src->raw + src->raw_pos, left);
+                    src->raw_pos = 0;
+                    src->raw_len = left + fread(src->raw + left, 1, RAW_BUFFER_SIZE - left, src->file);
+                    if (src->raw_len == left)
+                        src->file_eof = 1;
+                }
+                if (src->raw_len - src->raw_pos < 2 || src->raw[src->raw_pos] != 0x1f || src->raw[src->raw_pos + 1] != 0x8b)
+                {
+                    src->done = 1;
+                    break;
+                }
+                inflateReset(&src->gz); // concatenated gzip members, as produced by pigz or cat
+                src->member_ended = 0;
+            }
+            if (src->raw_pos == src->raw_len) // input ended, inflate has nothing left to give
+            {
+                src->done = 1;
+                break;
+            }
+            src->frame_open = 1;
+            src->gz.next_in = src->raw + src->raw_pos;
+            src->gz.avail_in = (uInt)(src->raw_len - src->raw_pos);
+            src->gz.next_out = (Bytef *)dst;
+            src->gz.avail_out = (uInt)cap;
+            int status = inflate(&src->gz, Z_NO_FLUSH);
+            src->raw_pos = src->raw_len - src->gz.avail_in;
+            produced = cap - src->gz.avail_out;
+            if (status == Z_STREAM_END)
+            {
+                src->member_ended = 1;
+                src->frame_open = 0;
+            }
+            else if (status != Z_OK && status != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "gzip decompression failed: %s\n", src->gz.msg ? src->gz.msg : "corrupt data");
+                return -1;
+            }
+        }
+#ifdef HAVE_ZSTD
+        else if (src->format == FORMAT_ZSTD)
+        {
+            if (src->raw_pos == src->raw_len)
+            {
+                src->done = 1;
+                break;
+            }
+            ZSTD_inBuffer in = {src->raw, src->raw_len, src->raw_pos};
+            ZSTD_outBuffer out = {dst, cap, 0};
+            size_t status = ZSTD_decompressStream(src->zs, &out, &in); // moves on to the next frame by itself
+            if (ZSTD_isError(status))
+            {
+                fprintf(stderr, "zstd decompression failed: %s\n", ZSTD_getErrorName(status));
+                return -1;
+            }
+            src->raw_pos = in.pos;
+            produced = out.pos;
+            src->frame_open = status != 0; // 0 once a frame is fully decoded and flushed
+        }
+#endif
+        if (produced > 0)
+            return (long)produced;
+    }
+    if (src->frame_open)
     {
-        fprintf(stderr, "Failed to allocate memory.\n");
-        fclose(file);
-        return;
+        fprintf(stderr, "Compressed input is truncated.\n");
+        return -1;
     }
+    return 0;
+}
 
-    for (int i = 0; i <= matrix->num_rows; i++)
+// Reads the comment lines and the size line. Bytes after the size line are left in carry
+static int read_header(InputSource *src, char *carry, size_t *carry_len, CSRMatrix *matrix)
+{
+    size_t len = 0;
+    int at_end = 0;
+    for (;;)
     {
-        matrix->row_ptr[i] = 0; // initializing row_ptr
+        if (!at_end && len < CHUNK_SIZE)
+        {
+            long n = source_read(src, carry + len, CHUNK_SIZE - len);
+            if (n < 0)
+                return 0;
+            if (n == 0)
+                at_end = 1;
+            len += n;
+        }
+
+        size_t pos = 0;
+        for (;;)
+        {
+            char *newline = memchr(carry + pos, '\n', len - pos);
+            if (newline == NULL && !(at_end && pos < len))
+                break;
+            size_t line_end = newline ? (size_t)(newline - carry) : len;
+            carry[line_end] = '\0';
+            char *line = carry + pos;
+            pos = newline ? line_end + 1 : len;
+            if (line[0] == '%' || line[strspn(line, " \t\r")] == '\0')
+                continue; // skipping comments and blank lines
+
+            if (sscanf(line, "%d %d %d", &matrix->num_rows, &matrix->num_cols, &matrix->num_non_zeros) != 3)
+            {
+                fprintf(stderr, "Invalid Matrix Market size line: %s\n", line);
+                return 0;
+            }
+            memmove(carry, carry + pos, len - pos);
+            *carry_len = len - pos;
+            return 1;
+        }
+
+        memmove(carry, carry + pos, len - pos); // keep the unfinished line
+        len -= pos;
+        if (at_end)
+        {
+            fprintf(stderr, "Missing Matrix Market size line.\n");
+            return 0;
+        }
+        if (len == CHUNK_SIZE)
+        {
+            fprintf(stderr, "Header line longer than %d bytes.\n", CHUNK_SIZE);
+            return 0;
+        }
     }
+}
 
-    int row, col;
-    double matrix_value; // initializing row, col, and value
-    // read the data entries and put numbers in row_ptr
-    while (fscanf(file, "%d %d %lf", &row, &col, &matrix_value) == 3)
+// Entries parsed from one chunk, kept in file order
+typedef struct {
+    int *rows;
+    int *cols;
+    double *values;
+    int count;
+} EntrySegment;
+
+enum { SLOT_EMPTY, SLOT_FILLED, SLOT_PARSING };
+
+typedef struct {
+    char *data; // CHUNK_SIZE + 1 bytes, the extra byte for a terminating '\0'
+    size_t len;
+    int seq;
+    int state;
+} ChunkSlot;
+
+// State shared between the decompressing producer and the parser threads
+typedef struct {
+    InputSource *src;
+    char *carry;
+    size_t carry_len;
+    int num_rows;
+    int num_cols;
+
+    ChunkSlot *slots;
+    int num_slots;
+    int chunks_produced;
+    int chunks_taken;
+    int producer_done;
+    int failed;
+
+    EntrySegment *segments; // Indexed by chunk sequence number
+    int segments_capacity;
+    long long invalid_entries;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} MMLoader;
+
+// Decompresses the input into the ring of chunks, each ending on a line boundary
+static void *mm_producer(void *arg)
+{
+    MMLoader *loader = (MMLoader *)arg;
+    int seq = 0;
+    int at_end = 0;
+
+    while (!at_end)
     {
-        row -= 1; // Convert to 0 based index
-        matrix->row_ptr[row + 1] += 1;
+        ChunkSlot *slot = &loader->slots[seq % loader->num_slots];
+        pthread_mutex_lock(&loader->lock);
+        while (slot->state != SLOT_EMPTY && !loader->failed)
+            pthread_cond_wait(&loader->changed, &loader->lock);
+        int failed = loader->failed;
+        pthread_mutex_unlock(&loader->lock);
+        if (failed)
+            break;
+
+        // Decompression runs without the lock so parsers keep working on earlier chunks
+        char *buf = slot->data;
+        memcpy(buf, loader->carry, loader->carry_len);
+        size_t len = loader->carry_len;
+        loader->carry_len = 0;
+        while (len < CHUNK_SIZE)
+        {
+            long n = source_read(loader->src, buf + len, CHUNK_SIZE - len);
+            if (n < 0)
+            {
+                failed = 1;
+                break;
+            }
+            if (n == 0)
+            {
+                at_end = 1;
+                break;
+            }
+            len += n;
+        }
+
+        if (!failed && !at_end)
+        {
+            char *last_newline = buf + len - 1;
+            while (last_newline >= buf && *last_newline != '\n')
+                last_newline--;
+            if (last_newline < buf)
+            {
+                fprintf(stderr, "Line longer than %d bytes.\n", CHUNK_SIZE);
+                failed = 1;
+            }
+            else
+            {
+                size_t keep = (size_t)(last_newline - buf) + 1;
+                loader->carry_len = len - keep;
+                memcpy(loader->carry, buf + keep, loader->carry_len);
+                len = keep;
+            }
+        }
+
+        pthread_mutex_lock(&loader->lock);
+        if (failed)
+        {
+            loader->failed = 1;
+        }
+        else if (len > 0)
+        {
+            buf[len] = '\0';
+            slot->len = len;
+            slot->seq = seq++;
+            slot->state = SLOT_FILLED;
+            loader->chunks_produced++;
+        }
+        pthread_cond_broadcast(&loader->changed);
+        pthread_mutex_unlock(&loader->lock);
+        if (failed)
+            break;
     }
 
-    // Accumulate the row pointers
-    for (int i = 1; i <= matrix->num_rows; i++)
+    pthread_mutex_lock(&loader->lock);
+    loader->producer_done = 1;
+    pthread_cond_broadcast(&loader->changed);
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+// Parses "row col value" lines of one chunk; chunk must be '\0'-terminated
+static EntrySegment parse_chunk(char *chunk, size_t len, int num_rows, int num_cols, long long *invalid)
+{
+    EntrySegment seg;
+    size_t capacity = len / 6 + 1; // shortest entry line is "1 1 1\n"
+    seg.rows = (int *)malloc(capacity * sizeof(int));
+    seg.cols = (int *)malloc(capacity * sizeof(int));
+    seg.values = (double *)malloc(capacity * sizeof(double));
+    seg.count = 0;
+    if (seg.rows == NULL || seg.cols == NULL || seg.values == NULL)
     {
-        matrix->row_ptr[i] += matrix->row_ptr[i - 1];
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
     }
 
-    fseek(file, 0, SEEK_SET); // going back to beginning of file
+    char *p = chunk;
+    char *chunk_end = chunk + len;
+    while (p < chunk_end)
+    {
+        char *line_end = memchr(p, '\n', chunk_end - p);
+        if (line_end == NULL)
+            line_end = chunk_end;
+        *line_end = '\0'; // stops strtol/strtod from running into the next line
+
+        char *end;
+        long row = strtol(p, &end, 10);
+        if (end != p && *p != '%')
+        {
+            char *col_start = end;
+            long col = strtol(col_start, &end, 10);
+            char *value_start = end;
+            double value = strtod(value_start, &end);
+            if (end != value_start && value_start != col_start && row >= 1 && row <= num_rows && col >= 1 && col <= num_cols)
+            {
+                seg.rows[seg.count] = (int)row - 1; // Convert to 0 based index
+                seg.cols[seg.count] = (int)col - 1;
+                seg.values[seg.count] = value;
+                seg.count++;
+            }
+            else
+            {
+                (*invalid)++;
+            }
+        }
+        p = line_end + 1;
+    }
+    return seg;
+}
 
-    while (fgets(line, sizeof(line), file))
+static void *mm_parser(void *arg)
+{
+    MMLoader *loader = (MMLoader *)arg;
+    for (;;)
     {
-        if (line[0] != '%')
+        pthread_mutex_lock(&loader->lock);
+        while (loader->chunks_taken == loader->chunks_produced && !loader->producer_done && !loader->failed)
+            pthread_cond_wait(&loader->changed, &loader->lock);
+        if (loader->chunks_taken == loader->chunks_produced || loader->failed)
+        {
+            pthread_mutex_unlock(&loader->lock);
             break;
+        }
+        ChunkSlot *slot = &loader->slots[loader->chunks_taken % loader->num_slots];
+        loader->chunks_taken++;
+        slot->state = SLOT_PARSING;
+        pthread_mutex_unlock(&loader->lock);
+
+        long long invalid = 0;
+        EntrySegment seg = parse_chunk(slot->data, slot->len, loader->num_rows, loader->num_cols, &invalid);
+
+        pthread_mutex_lock(&loader->lock);
+        if (slot->seq >= loader->segments_capacity)
+        {
+            int new_capacity = loader->segments_capacity * 2 > slot->seq + 1 ? loader->segments_capacity * 2 : slot->seq + 1;
+            EntrySegment *grown = (EntrySegment *)realloc(loader->segments, new_capacity * sizeof(EntrySegment));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Failed to allocate memory.\n");
+                exit(EXIT_FAILURE);
+            }
+            memset(grown + loader->segments_capacity, 0, (new_capacity - loader->segments_capacity) * sizeof(EntrySegment));
+            loader->segments = grown;
+            loader->segments_capacity = new_capacity;
+        }
+        loader->segments[slot->seq] = seg;
+        loader->invalid_entries += invalid;
+        slot->state = SLOT_EMPTY;
+        pthread_cond_broadcast(&loader->changed);
+        pthread_mutex_unlock(&loader->lock);
     }
+    return NULL;
+}
 
-    int *temp_row_ptr = (int *)malloc((matrix->num_rows + 1) * sizeof(int)); // allocating memory to store temp row pointers for matrix
-    if (temp_row_ptr == NULL)
+// Counts the CPUs this process may run on, so taskset and cpusets limit the parsers too
+static int parse_thread_count(void)
+{
+    cpu_set_t mask;
+    int cpus = sched_getaffinity(0, sizeof(mask), &mask) == 0 ? CPU_COUNT(&mask) : 1;
+    int threads = cpus > 1 ? cpus - 1 : 1; // one core is left to the decompressing producer
+    return threads < MAX_PARSE_THREADS ? threads : MAX_PARSE_THREADS;
+}
+
+// Reads a Matrix Market file in a single forward pass. Input may be plain, gzip or zstd
+// (detected from its magic bytes) and may be a pipe; "-" reads standard input. A producer
+// thread decompresses into a ring of chunks while parser threads turn chunks into entries.
+void ReadMMtoCSR(const char *filename, CSRMatrix *matrix)
+{
+    matrix->csr_data = NULL;
+    matrix->col_ind = NULL;
+    matrix->row_ptr = NULL;
+    matrix->num_non_zeros = matrix->num_rows = matrix->num_cols = 0;
+
+    FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", filename); // handling input error
+        return;
+    }
+
+    InputSource src;
+    memset(&src, 0, sizeof(src));
+    char *carry = (char *)malloc(CHUNK_SIZE + 1);
+    size_t carry_len = 0;
+    if (carry == NULL || !source_open(&src, file) || !read_header(&src, carry, &carry_len, matrix))
+    {
+        fprintf(stderr, "Failed to read file %s\n", filename);
+        free(carry);
+        source_close(&src);
+        if (file != stdin)
+            fclose(file);
+        return;
+    }
+
+    int num_parsers = parse_thread_count();
+    MMLoader loader;
+    memset(&loader, 0, sizeof(loader));
+    loader.src = &src;
+    loader.carry = carry;
+    loader.carry_len = carry_len;
+    loader.num_rows = matrix->num_rows;
+    loader.num_cols = matrix->num_cols;
+    loader.num_slots = 2 * num_parsers + 2; // enough for every parser to hold one chunk while the producer fills the next
+    loader.slots = (ChunkSlot *)calloc(loader.num_slots, sizeof(ChunkSlot));
+    int slots_ok = loader.slots != NULL;
+    for (int i = 0; slots_ok && i < loader.num_slots; i++)
+    {
+        loader.slots[i].data = (char *)malloc(CHUNK_SIZE + 1);
+        slots_ok = loader.slots[i].data != NULL;
+    }
+
+    if (!slots_ok) // incase memory allocation was failed
     {
         fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&loader.lock, NULL);
+    pthread_cond_init(&loader.changed, NULL);
+    pthread_t producer;
+    pthread_t parsers[MAX_PARSE_THREADS];
+    int producer_started = pthread_create(&producer, NULL, mm_producer, &loader) == 0;
+    int parsers_started = 0;
+    while (producer_started && parsers_started < num_parsers &&
+           pthread_create(&parsers[parsers_started], NULL, mm_parser, &loader) == 0)
+    {
+        parsers_started++;
+    }
+    if (!producer_started || parsers_started < num_parsers)
+    {
+        // Stop the threads that did start; they all check failed while waiting
+        fprintf(stderr, "Failed to create thread.\n");
+        pthread_mutex_lock(&loader.lock);
+        loader.failed = 1;
+        pthread_cond_broadcast(&loader.changed);
+        pthread_mutex_unlock(&loader.lock);
+    }
+    if (producer_started)
+        pthread_join(producer, NULL);
+    for (int i = 0; i < parsers_started; i++)
+    {
+        pthread_join(parsers[i], NULL);
+    }
+    pthread_mutex_destroy(&loader.lock);
+    pthread_cond_destroy(&loader.changed);
+
+    for (int i = 0; i < loader.num_slots; i++)
+    {
+        free(loader.slots[i].data);
+    }
+    free(loader.slots);
+    free(carry);
+    source_close(&src);
+    if (file != stdin)
         fclose(file);
+
+    if (loader.failed)
+    {
+        fprintf(stderr, "Failed to read file %s\n", filename);
+        for (int s = 0; s < loader.segments_capacity; s++)
+        {
+            free(loader.segments[s].rows);
+            free(loader.segments[s].cols);
+            free(loader.segments[s].values);
+        }
+        free(loader.segments);
+        matrix->num_non_zeros = matrix->num_rows = matrix->num_cols = 0;
         return;
     }
+    if (loader.invalid_entries > 0)
+    {
+        fprintf(stderr, "Warning: skipped %lld invalid entries in %s\n", loader.invalid_entries, filename);
+    }
+
+    long long entries_read = 0;
+    for (int s = 0; s < loader.chunks_produced; s++)
+    {
+        entries_read += loader.segments[s].count;
+    }
+    if (entries_read != matrix->num_non_zeros)
+    {
+        fprintf(stderr, "Warning: %s declares %d entries but contains %lld\n", filename, matrix->num_non_zeros, entries_read);
+        if (entries_read < matrix->num_non_zeros)
+            matrix->num_non_zeros = (int)entries_read;
+    }
+
+    int *temp_row_ptr = (int *)calloc(matrix->num_rows + 1, sizeof(int)); // allocating memory to store temp row pointers for matrix
+    if (temp_row_ptr == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Count entries per row, only the first num_non_zeros entries are kept
+    int remaining = matrix->num_non_zeros;
+    for (int s = 0; s < loader.chunks_produced && remaining > 0; s++)
+    {
+        EntrySegment *seg = &loader.segments[s];
+        int n = seg->count < remaining ? seg->count : remaining;
+        for (int k = 0; k < n; k++)
+        {
+            temp_row_ptr[seg->rows[k] + 1] += 1;
+        }
+        remaining -= n;
+    }
+
+    // Accumulate the row pointers
+    for (int i = 1; i <= matrix->num_rows; i++)
+    {
+        temp_row_ptr[i] += temp_row_ptr[i - 1];
+    }
 
-    memcpy(temp_row_ptr, matrix->row_ptr, (matrix->num_rows + 1) * sizeof(int)); // copy memory from row_ptr to temp_row_ptr
+    // The arrays are allocated only now that the row layout is known, so each partition is first touched by its thread
+    placeCSR(matrix, temp_row_ptr);
 
-    // reading data and assigning values for csr_data and col_ind
-    while (fscanf(file, "%d %d %lf", &row, &col, &matrix_value) == 3)
+    // Scatter segments in file order, so entries within a row keep their order in the file
+    remaining = matrix->num_non_zeros;
+    for (int s = 0; s < loader.chunks_produced; s++)
     {
-        row -= 1;
-        col -= 1; // Convert both rows and cols to 0 based index
-        int index = temp_row_ptr[row]++;
-        matrix->csr_data[index] = matrix_value;
-        matrix->col_ind[index] = col;
+        EntrySegment *seg = &loader.segments[s];
+        int n = seg->count < remaining ? seg->count : remaining;
+        for (int k = 0; k < n; k++)
+        {
+            int index = temp_row_ptr[seg->rows[k]]++;
+            matrix->csr_data[index] = seg->values[k];
+            matrix->col_ind[index] = seg->cols[k];
+        }
+        remaining -= n;
+        free(seg->rows);
+        free(seg->cols);
+        free(seg->values);
     }
 
     free(temp_row_ptr);
-    fclose(file);
+    free(loader.segments);
 }
 
 void freeCSR(CSRMatrix *matrix)
 {
-    free(matrix->csr_data);
-    free(matrix->col_ind);
-    free(matrix->row_ptr);
+    freeCSRArray(matrix->csr_data);
+    freeCSRArray(matrix->col_ind);
+    freeCSRArray(matrix->row_ptr);
 }
 
 void print_CSR_Matrix(const CSRMatrix *matrix)
@@ -115,6 +697,55 @@ void print_CSR_Matrix(const CSRMatrix *matrix)
     printf("\n");
 }
 
+// Replaces the kernel's scratch arrays in C (malloc'd, num_rows + 1 row pointers) with
+// placed arrays holding only the non-zero entries
+static void removeZerosCSR(CSRMatrix *C)
+{
+    int *kept_row_ptr = (int *)malloc((C->num_rows + 1) * sizeof(int));
+    if (kept_row_ptr == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int count = 0;
+    for (int i = 0; i < C->num_rows; i++)
+    {
+        kept_row_ptr[i] = count;
+        for (int j = C->row_ptr[i]; j < C->row_ptr[i + 1]; j++)
+        {
+            if (C->csr_data[j] != 0)
+                count++;
+        }
+    }
+    kept_row_ptr[C->num_rows] = count;
+
+    CSRMatrix kept;
+    kept.num_rows = C->num_rows;
+    kept.num_cols = C->num_cols;
+    placeCSR(&kept, kept_row_ptr);
+
+    count = 0;
+    for (int i = 0; i < C->num_rows; i++)
+    {
+        for (int j = C->row_ptr[i]; j < C->row_ptr[i + 1]; j++)
+        {
+            if (C->csr_data[j] != 0)
+            {
+                kept.csr_data[count] = C->csr_data[j];
+                kept.col_ind[count] = C->col_ind[j];
+                count++;
+            }
+        }
+    }
+
+    free(C->csr_data);
+    free(C->col_ind);
+    free(C->row_ptr);
+    free(kept_row_ptr);
+    *C = kept;
+}
+
 // Function to add two sparse matrices in CSR format
 CSRMatrix addCSR(const CSRMatrix *A, const CSRMatrix *B)
 {
@@ -200,47 +831,8 @@ CSRMatrix addCSR(const CSRMatrix *A, const CSRMatrix *B)
 
     C.row_ptr[C.num_rows] = counter;
 
-    // Allocating new arrays to filter out any added zeros
-    double *correct_csr_data = (double *)malloc(counter * sizeof(double));
-    int *correct_col_ind = (int *)malloc(counter * sizeof(int));
-    int *correct_row_ptr = (int *)calloc(C.num_rows + 1, sizeof(int));
-    if (correct_csr_data == NULL || correct_col_ind == NULL || correct_row_ptr == NULL)
-    {
-        fprintf(stderr, "Failed to allocate memory.\n");
-        free(C.row_ptr);
-        free(C.csr_data);
-        free(C.col_ind);
-        free(col_tracker);
-        exit(EXIT_FAILURE);
-    }
-
-    int correct_num_values = 0;
-    for (int i = 0; i < C.num_rows; i++)
-    {
-        correct_row_ptr[i] = correct_num_values;
-
-        for (int j = C.row_ptr[i]; j < C.row_ptr[i + 1]; j++)
-        {
-            if (C.csr_data[j] != 0)
-            {
-                correct_csr_data[correct_num_values] = C.csr_data[j];
-                correct_col_ind[correct_num_values] = C.col_ind[j];
-                correct_num_values += 1;
-            }
-        }
-    }
-
-    correct_row_ptr[C.num_rows] = correct_num_values;
-
-    free(C.csr_data);
-    free(C.col_ind);
-    free(C.row_ptr);
     free(col_tracker);
-
-    C.csr_data = correct_csr_data;
-    C.col_ind = correct_col_ind;
-    C.row_ptr = correct_row_ptr;
-    C.num_non_zeros = correct_num_values;
+    removeZerosCSR(&C); // filter out any added zeros
 
     return C;
 }
@@ -321,47 +913,8 @@ CSRMatrix subtractCSR(const CSRMatrix *A, const CSRMatrix *B)
     }
     C.row_ptr[C.num_rows] = count; // End of last row
 
-    // Remove zeros and update row pointers
-    double *final_data = (double *)malloc(count * sizeof(double));
-    int *final_indices = (int *)malloc(count * sizeof(int));
-    int *final_ptr = (int *)calloc(C.num_rows + 1, sizeof(int));
-
-    if (!final_data || !final_indices || !final_ptr)
-    {
-        fprintf(stderr, "Memory allocation failed.\n");
-        free(C.row_ptr);
-        free(C.csr_data);
-        free(C.col_ind);
-        free(col_mark);
-        exit(EXIT_FAILURE);
-    }
-
-    int final_counter = 0;
-    for (int row = 0; row < C.num_rows; row++)
-    {
-        final_ptr[row] = final_counter;
-        for (int index = C.row_ptr[row]; index < C.row_ptr[row + 1]; index++)
-        {
-            if (C.csr_data[index] != 0)
-            {
-                final_data[final_counter] = C.csr_data[index];
-                final_indices[final_counter] = C.col_ind[index];
-                final_counter++;
-            }
-        }
-    }
-    final_ptr[C.num_rows] = final_counter;
-
-    // Free temporary memory
-    free(C.csr_data);
-    free(C.col_ind);
-    free(C.row_ptr);
     free(col_mark);
-
-    C.csr_data = final_data;
-    C.col_ind = final_indices;
-    C.row_ptr = final_ptr;
-    C.num_non_zeros = final_counter;
+    removeZerosCSR(&C); // Remove zeros and update row pointers
 
     return C;
 }
@@ -456,122 +1009,954 @@ CSRMatrix multiplyCSR(const CSRMatrix *A, const CSRMatrix *B)
 
     result.row_ptr[result.num_rows] = entryCount; // End of row pointers
 
-    // Filter out zero entries
-    double *cleanedData = (double *)malloc(entryCount * sizeof(double));
-    int *cleanedColInd = (int *)malloc(entryCount * sizeof(int));
-    int *cleanedRowPtr = (int *)calloc(result.num_rows + 1, sizeof(int));
+    free(columnFlags);
+    removeZerosCSR(&result); // Filter out zero entries
+
+    return result; 
+}
+// Function to transpose a CSR matrix
+CSRMatrix transposeCSR(const CSRMatrix *A)
+{
+    CSRMatrix T;                        // Create a new matrix for the transpose
+    T.num_rows = A->num_cols;           // Number of rows in T is the number of columns in A
+    T.num_cols = A->num_rows;           // Number of columns in T is the number of rows in A
 
-    if (cleanedData == NULL || cleanedColInd == NULL || cleanedRowPtr == NULL) 
+    // Row pointers of T are computed first, the arrays are allocated once the layout is known
+    int *t_row_ptr = (int *)calloc(T.num_rows + 1, sizeof(int));
+    if (t_row_ptr == NULL)
     {
-        fprintf(stderr, "Failed to allocate memory for filtered data.\n");
-        free(result.row_ptr);
-        free(result.csr_data);
-        free(result.col_ind);
-        free(columnFlags);
-        exit(1);
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Count the number of entries in each column of A
+    for (int i = 0; i < A->num_non_zeros; i++)
+    {
+        t_row_ptr[A->col_ind[i] + 1]++;
+    }
+
+    // Calculate row_ptr values for T
+    for (int i = 1; i <= T.num_rows; i++)
+    {
+        t_row_ptr[i] += t_row_ptr[i - 1];
+    }
+
+    // Allocate memory for row_ptr, csr_data, and col_ind; number of non-zero elements remains the same
+    placeCSR(&T, t_row_ptr);
+
+    // Track current position in each row of T
+    int *position_tracker = t_row_ptr;
+
+    // Fill csr_data and col_ind for T
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            int col = A->col_ind[j];
+            int index_in_T = position_tracker[col];
+
+            T.csr_data[index_in_T] = A->csr_data[j];
+            T.col_ind[index_in_T] = i;
+
+            position_tracker[col]++;
+        }
     }
-    
-    int nonZeroCount = 0; 
-    for (int i = 0; i < result.num_rows; i++)
+
+    free(position_tracker);
+    return T;
+}
+
+
+// Compressed rows: the first column as 4 bytes, then one delta per further entry,
+// each row_width[i] bytes wide. A fixed width per row keeps the decode loop free of branches.
+
+static double for_each_partition(const int *row_ptr, int num_rows, void *task, void (*work)(void *, int, int), int passes);
+
+static int delta_width(int max_gap)
+{
+    return max_gap < 256 ? 1 : max_gap < 65536 ? 2 : 4;
+}
+
+static inline int load_first_col(const unsigned char *p)
+{
+    int col;
+    memcpy(&col, p, sizeof(col));
+    return col;
+}
+
+// Decodes the column indices of row i into cols (at least A->max_row_length entries)
+static inline void decode_row(const CompressedCSRMatrix *A, int i, int *cols)
+{
+    int length = A->row_ptr[i + 1] - A->row_ptr[i];
+    if (length == 0)
+        return;
+    const unsigned char *p = A->col_bytes + A->byte_ptr[i];
+    int col = load_first_col(p);
+    cols[0] = col;
+    p += sizeof(int);
+
+    switch (A->row_width[i])
     {
-        cleanedRowPtr[i] = nonZeroCount; 
-        for (int j = result.row_ptr[i]; j < result.row_ptr[i + 1]; j++)  
+    case 1:
+        for (int k = 1; k < length; k++)
+        {
+            col += p[k - 1];
+            cols[k] = col;
+        }
+        break;
+    case 2:
+        for (int k = 1; k < length; k++)
         {
-            if (result.csr_data[j] != 0) 
+            uint16_t delta;
+            memcpy(&delta, p + 2 * (k - 1), sizeof(delta));
+            col += delta;
+            cols[k] = col;
+        }
+        break;
+    default:
+        for (int k = 1; k < length; k++)
+        {
+            uint32_t delta;
+            memcpy(&delta, p + 4 * (k - 1), sizeof(delta));
+            col += (int)delta;
+            cols[k] = col;
+        }
+        break;
+    }
+}
+
+typedef struct {
+    int col;
+    double value;
+} ColumnEntry;
+
+static int compare_column_entries(const void *a, const void *b)
+{
+    int col_a = ((const ColumnEntry *)a)->col;
+    int col_b = ((const ColumnEntry *)b)->col;
+    return (col_a > col_b) - (col_a < col_b);
+}
+
+typedef struct {
+    CompressedCSRMatrix *Z;
+    const ColumnEntry *entries; // A's entries, each row sorted by column
+    const int *row_ptr;
+    const int *byte_ptr;
+    const unsigned char *row_width;
+} EncodeTask;
+
+// Writes rows [first_row, last_row) of the compressed matrix, so each partition is first touched by its thread
+static void encode_rows(void *arg, int first_row, int last_row)
+{
+    EncodeTask *task = (EncodeTask *)arg;
+    CompressedCSRMatrix *Z = task->Z;
+    for (int i = first_row; i < last_row; i++)
+    {
+        int start = task->row_ptr[i];
+        int end = task->row_ptr[i + 1];
+        int width = task->row_width[i];
+        Z->row_ptr[i] = start;
+        Z->byte_ptr[i] = task->byte_ptr[i];
+        Z->row_width[i] = (unsigned char)width;
+        if (start == end)
+            continue;
+
+        unsigned char *out = Z->col_bytes + task->byte_ptr[i];
+        memcpy(out, &task->entries[start].col, sizeof(int));
+        out += sizeof(int);
+        Z->csr_data[start] = task->entries[start].value;
+        for (int j = start + 1; j < end; j++)
+        {
+            uint32_t delta = (uint32_t)(task->entries[j].col - task->entries[j - 1].col);
+            if (width == 1)
+            {
+                *out = (unsigned char)delta;
+            }
+            else if (width == 2)
+            {
+                uint16_t narrow = (uint16_t)delta;
+                memcpy(out, &narrow, sizeof(narrow));
+            }
+            else
             {
-                cleanedData[nonZeroCount] = result.csr_data[j]; 
-                cleanedColInd[nonZeroCount] = result.col_ind[j]; 
-                nonZeroCount++; 
+                memcpy(out, &delta, sizeof(delta));
             }
+            out += width;
+            Z->csr_data[j] = task->entries[j].value;
         }
     }
- 
-    cleanedRowPtr[result.num_rows] = nonZeroCount; 
-    free(result.csr_data);
-    free(result.col_ind);
-    free(result.row_ptr);
- 
-    result.csr_data = cleanedData; 
-    result.col_ind = cleanedColInd; 
-    result.row_ptr = cleanedRowPtr; 
-    result.num_non_zeros = nonZeroCount; 
- 
-    free(columnFlags);
- 
-    return result; 
 }
-// Function to transpose a CSR matrix
-CSRMatrix transposeCSR(const CSRMatrix *A)
+
+// Rows are sorted by column while compressing so that deltas are small and non-negative
+CompressedCSRMatrix compressCSR(const CSRMatrix *A)
 {
-    CSRMatrix T;                        // Create a new matrix for the transpose
-    T.num_rows = A->num_cols;           // Number of rows in T is the number of columns in A
-    T.num_cols = A->num_rows;           // Number of columns in T is the number of rows in A
-    T.num_non_zeros = A->num_non_zeros; // Number of non-zero elements remains the same
+    CompressedCSRMatrix Z;
+    Z.num_rows = A->num_rows;
+    Z.num_cols = A->num_cols;
+    Z.num_non_zeros = A->num_non_zeros;
+    Z.max_row_length = 0;
+
+    ColumnEntry *entries = (ColumnEntry *)malloc((Z.num_non_zeros > 0 ? Z.num_non_zeros : 1) * sizeof(ColumnEntry));
+    int *byte_ptr = (int *)malloc((Z.num_rows + 1) * sizeof(int));
+    unsigned char *row_width = (unsigned char *)malloc(Z.num_rows > 0 ? Z.num_rows : 1);
+    if (entries == NULL || byte_ptr == NULL || row_width == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // First pass: sort each row, pick its delta width and size its encoded indices
+    long long total_bytes = 0;
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        int start = A->row_ptr[i];
+        int end = A->row_ptr[i + 1];
+        byte_ptr[i] = (int)total_bytes;
+        int sorted = 1;
+        for (int j = start; j < end; j++)
+        {
+            entries[j].col = A->col_ind[j];
+            entries[j].value = A->csr_data[j];
+            if (j > start && A->col_ind[j] < A->col_ind[j - 1])
+                sorted = 0;
+        }
+        if (!sorted)
+            qsort(entries + start, end - start, sizeof(ColumnEntry), compare_column_entries);
 
-    // Allocate memory for row_ptr, csr_data, and col_ind
-    T.row_ptr = (int *)calloc(T.num_rows + 1, sizeof(int));
-    if (T.row_ptr == NULL)
+        int max_gap = 0;
+        for (int j = start + 1; j < end; j++)
+        {
+            if (entries[j].col - entries[j - 1].col > max_gap)
+                max_gap = entries[j].col - entries[j - 1].col;
+        }
+        row_width[i] = (unsigned char)delta_width(max_gap);
+        if (end > start)
+            total_bytes += sizeof(int) + (long long)(end - start - 1) * row_width[i];
+        if (end - start > Z.max_row_length)
+            Z.max_row_length = end - start;
+        if (total_bytes > INT_MAX)
+        {
+            fprintf(stderr, "Error: Compressed column indices exceed %d bytes.\n", INT_MAX);
+            exit(EXIT_FAILURE);
+        }
+    }
+    byte_ptr[Z.num_rows] = (int)total_bytes;
+    Z.num_bytes = (int)total_bytes;
+
+    Z.row_ptr = (int *)allocCSRArray((Z.num_rows + 1) * sizeof(int));
+    Z.byte_ptr = (int *)allocCSRArray((Z.num_rows + 1) * sizeof(int));
+    Z.row_width = (unsigned char *)allocCSRArray(Z.num_rows);
+    Z.csr_data = (double *)allocCSRArray(Z.num_non_zeros * sizeof(double));
+    Z.col_bytes = (unsigned char *)allocCSRArray(Z.num_bytes);
+    if (Z.row_ptr == NULL || Z.byte_ptr == NULL || Z.row_width == NULL || Z.csr_data == NULL || Z.col_bytes == NULL)
     {
         fprintf(stderr, "Failed to allocate memory.\n");
         exit(EXIT_FAILURE);
     }
 
-    T.csr_data = (double *)malloc(T.num_non_zeros * sizeof(double));
-    if (T.csr_data == NULL)
+    // Second pass: encode, partitioned like the parallel kernels
+    EncodeTask task = {&Z, entries, A->row_ptr, byte_ptr, row_width};
+    for_each_partition(A->row_ptr, A->num_rows, &task, encode_rows, 1);
+    Z.row_ptr[Z.num_rows] = A->row_ptr[A->num_rows];
+    Z.byte_ptr[Z.num_rows] = byte_ptr[Z.num_rows];
+
+    free(entries);
+    free(byte_ptr);
+    free(row_width);
+    return Z;
+}
+
+CSRMatrix decompressCSR(const CompressedCSRMatrix *A)
+{
+    CSRMatrix C;
+    C.num_rows = A->num_rows;
+    C.num_cols = A->num_cols;
+    placeCSR(&C, A->row_ptr);
+
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        decode_row(A, i, C.col_ind + A->row_ptr[i]);
+    }
+
+    memcpy(C.csr_data, A->csr_data, C.num_non_zeros * sizeof(double));
+    return C;
+}
+
+void freeCompressedCSR(CompressedCSRMatrix *matrix)
+{
+    freeCSRArray(matrix->csr_data);
+    freeCSRArray(matrix->col_bytes);
+    freeCSRArray(matrix->row_ptr);
+    freeCSRArray(matrix->byte_ptr);
+    freeCSRArray(matrix->row_width);
+}
+
+static int *alloc_row_buffer(const CompressedCSRMatrix *A)
+{
+    int *cols = (int *)malloc((A->max_row_length > 0 ? A->max_row_length : 1) * sizeof(int));
+    if (cols == NULL)
     {
         fprintf(stderr, "Failed to allocate memory.\n");
-        free(T.row_ptr);
         exit(EXIT_FAILURE);
     }
+    return cols;
+}
 
-    T.col_ind = (int *)malloc(T.num_non_zeros * sizeof(int));
-    if (T.col_ind == NULL)
+// Same algorithm as addCSR, each row of A and B is decoded as it is visited
+CSRMatrix addCompressedCSR(const CompressedCSRMatrix *A, const CompressedCSRMatrix *B)
+{
+    if (A->num_rows != B->num_rows || A->num_cols != B->num_cols)
+    {
+        fprintf(stderr, "Error: Matrix dimensions do not match. Make sure numbers of rows and columns match.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    CSRMatrix C;
+    C.num_rows = A->num_rows;
+    C.num_cols = A->num_cols;
+
+    int max_non_zeros = A->num_non_zeros + B->num_non_zeros;
+    C.row_ptr = (int *)calloc(C.num_rows + 1, sizeof(int));
+    C.csr_data = (double *)malloc(max_non_zeros * sizeof(double));
+    C.col_ind = (int *)malloc(max_non_zeros * sizeof(int));
+    int *col_tracker = (int *)malloc(C.num_cols * sizeof(int));
+
+    if (col_tracker == NULL || C.row_ptr == NULL || C.csr_data == NULL || C.col_ind == NULL)
     {
         fprintf(stderr, "Failed to allocate memory.\n");
-        free(T.row_ptr);
-        free(T.csr_data);
+        free(C.csr_data);
+        free(C.col_ind);
+        free(C.row_ptr);
+        free(col_tracker);
         exit(EXIT_FAILURE);
     }
+    memset(col_tracker, -1, C.num_cols * sizeof(int));
+    int *a_cols = alloc_row_buffer(A);
+    int *b_cols = alloc_row_buffer(B);
 
-    // Count the number of entries in each column of A
-    for (int i = 0; i < A->num_non_zeros; i++)
+    int counter = 0;
+    for (int i = 0; i < C.num_rows; i++)
+    {
+        C.row_ptr[i] = counter;
+
+        decode_row(A, i, a_cols);
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            int col = a_cols[j - A->row_ptr[i]];
+            C.csr_data[counter] = A->csr_data[j];
+            C.col_ind[counter] = col;
+            col_tracker[col] = counter;
+            counter += 1;
+        }
+
+        decode_row(B, i, b_cols);
+        for (int j = B->row_ptr[i]; j < B->row_ptr[i + 1]; j++)
+        {
+            int col = b_cols[j - B->row_ptr[i]];
+            if (col_tracker[col] != -1)
+            {
+                C.csr_data[col_tracker[col]] += B->csr_data[j];
+            }
+            else
+            {
+                C.csr_data[counter] = B->csr_data[j];
+                C.col_ind[counter] = col;
+                col_tracker[col] = counter;
+                counter += 1;
+            }
+        }
+
+        // Every column touched in this row is now in C, reset from there
+        for (int j = C.row_ptr[i]; j < counter; j++)
+        {
+            col_tracker[C.col_ind[j]] = -1;
+        }
+    }
+    C.row_ptr[C.num_rows] = counter;
+
+    free(a_cols);
+    free(b_cols);
+    free(col_tracker);
+    removeZerosCSR(&C);
+    return C;
+}
+
+// Same algorithm as multiplyCSR, output is sized from the exact number of products instead of a fixed estimate
+CSRMatrix multiplyCompressedCSR(const CompressedCSRMatrix *A, const CompressedCSRMatrix *B)
+{
+    if (A->num_cols != B->num_rows)
     {
-        T.row_ptr[A->col_ind[i] + 1]++;
+        fprintf(stderr, "Error: Matrices dimensions do not match for multiplication.\n");
+        exit(1);
     }
 
-    // Calculate row_ptr values for T
-    for (int i = 1; i <= T.num_rows; i++)
+    CSRMatrix result;
+    result.num_rows = A->num_rows;
+    result.num_cols = B->num_cols;
+    int *a_cols = alloc_row_buffer(A);
+    int *b_cols = alloc_row_buffer(B);
+
+    // Upper bound on entries of the result: one per scalar product, at most num_cols per row
+    long long max_entries = 0;
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        decode_row(A, i, a_cols);
+        long long row_entries = 0;
+        for (int k = 0; k < A->row_ptr[i + 1] - A->row_ptr[i]; k++)
+        {
+            row_entries += B->row_ptr[a_cols[k] + 1] - B->row_ptr[a_cols[k]];
+        }
+        max_entries += row_entries < result.num_cols ? row_entries : result.num_cols;
+    }
+    if (max_entries > INT_MAX)
     {
-        T.row_ptr[i] += T.row_ptr[i - 1];
+        fprintf(stderr, "Error: Result may exceed %d non-zero entries.\n", INT_MAX);
+        exit(1);
     }
 
-    // Track current position in each row of T
-    int *position_tracker = (int *)malloc(T.num_rows * sizeof(int));
+    result.row_ptr = (int *)calloc(result.num_rows + 1, sizeof(int));
+    result.csr_data = (double *)malloc((max_entries > 0 ? max_entries : 1) * sizeof(double));
+    result.col_ind = (int *)malloc((max_entries > 0 ? max_entries : 1) * sizeof(int));
+    int *columnFlags = (int *)malloc(result.num_cols * sizeof(int));
+    if (result.row_ptr == NULL || result.csr_data == NULL || result.col_ind == NULL || columnFlags == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        free(result.row_ptr);
+        free(result.csr_data);
+        free(result.col_ind);
+        free(columnFlags);
+        exit(1);
+    }
+    memset(columnFlags, -1, result.num_cols * sizeof(int));
+
+    int entryCount = 0;
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        result.row_ptr[i] = entryCount;
+
+        decode_row(A, i, a_cols);
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            int a_col = a_cols[j - A->row_ptr[i]];
+            double a_val = A->csr_data[j];
+
+            decode_row(B, a_col, b_cols);
+            for (int k = B->row_ptr[a_col]; k < B->row_ptr[a_col + 1]; k++)
+            {
+                int b_col = b_cols[k - B->row_ptr[a_col]];
+                double b_val = B->csr_data[k];
+                if (columnFlags[b_col] < result.row_ptr[i])
+                {
+                    columnFlags[b_col] = entryCount;
+                    result.col_ind[entryCount] = b_col;
+                    result.csr_data[entryCount] = a_val * b_val;
+                    entryCount++;
+                }
+                else
+                {
+                    result.csr_data[columnFlags[b_col]] += a_val * b_val;
+                }
+            }
+        }
+
+        for (int j = result.row_ptr[i]; j < entryCount; j++)
+        {
+            columnFlags[result.col_ind[j]] = -1;
+        }
+    }
+    result.row_ptr[result.num_rows] = entryCount;
+
+    free(a_cols);
+    free(b_cols);
+    free(columnFlags);
+    removeZerosCSR(&result);
+    return result;
+}
+
+// Same algorithm as transposeCSR; A is decoded twice (counting pass and scatter pass)
+CSRMatrix transposeCompressedCSR(const CompressedCSRMatrix *A)
+{
+    CSRMatrix T;
+    T.num_rows = A->num_cols;
+    T.num_cols = A->num_rows;
+
+    int *position_tracker = (int *)calloc(T.num_rows + 1, sizeof(int));
     if (position_tracker == NULL)
     {
         fprintf(stderr, "Failed to allocate memory.\n");
-        free(T.row_ptr);
-        free(T.csr_data);
-        free(T.col_ind);
         exit(EXIT_FAILURE);
     }
-    memcpy(position_tracker, T.row_ptr, T.num_rows * sizeof(int)); // Copy row_ptr to position_tracker
+    int *cols = alloc_row_buffer(A);
 
-    // Fill csr_data and col_ind for T
+    // Count the number of entries in each column of A
     for (int i = 0; i < A->num_rows; i++)
     {
-        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        decode_row(A, i, cols);
+        for (int k = 0; k < A->row_ptr[i + 1] - A->row_ptr[i]; k++)
         {
-            int col = A->col_ind[j];
-            int index_in_T = position_tracker[col];
+            position_tracker[cols[k] + 1]++;
+        }
+    }
+
+    for (int i = 1; i <= T.num_rows; i++)
+    {
+        position_tracker[i] += position_tracker[i - 1];
+    }
+    placeCSR(&T, position_tracker);
 
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        decode_row(A, i, cols);
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            int index_in_T = position_tracker[cols[j - A->row_ptr[i]]]++;
             T.csr_data[index_in_T] = A->csr_data[j];
             T.col_ind[index_in_T] = i;
-
-            position_tracker[col]++;
         }
     }
 
+    free(cols);
     free(position_tracker);
     return T;
 }
+
+void spmvCSR(const CSRMatrix *A, const double *x, double *y)
+{
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        double sum = 0.0;
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            sum += A->csr_data[j] * x[A->col_ind[j]];
+        }
+        y[i] = sum;
+    }
+}
+
+typedef struct {
+    const CompressedCSRMatrix *A;
+    const double *x;
+    double *y;
+} CompressedSpmvTask;
+
+// Decodes on the fly; the width switch is per row, the inner loops have no branches
+static void spmv_compressed_rows(void *arg, int first_row, int last_row)
+{
+    CompressedSpmvTask *task = (CompressedSpmvTask *)arg;
+    const CompressedCSRMatrix *A = task->A;
+    const double *x = task->x;
+    for (int i = first_row; i < last_row; i++)
+    {
+        int start = A->row_ptr[i];
+        int length = A->row_ptr[i + 1] - start;
+        if (length == 0)
+        {
+            task->y[i] = 0.0;
+            continue;
+        }
+        const double *values = A->csr_data + start;
+        const unsigned char *p = A->col_bytes + A->byte_ptr[i];
+        int col = load_first_col(p);
+        p += sizeof(int);
+        double sum = values[0] * x[col];
+
+        switch (A->row_width[i])
+        {
+        case 1:
+            for (int k = 1; k < length; k++)
+            {
+                col += p[k - 1];
+                sum += values[k] * x[col];
+            }
+            break;
+        case 2:
+            for (int k = 1; k < length; k++)
+            {
+                uint16_t delta;
+                memcpy(&delta, p + 2 * (k - 1), sizeof(delta));
+                col += delta;
+                sum += values[k] * x[col];
+            }
+            break;
+        default:
+            for (int k = 1; k < length; k++)
+            {
+                uint32_t delta;
+                memcpy(&delta, p + 4 * (k - 1), sizeof(delta));
+                col += (int)delta;
+                sum += values[k] * x[col];
+            }
+            break;
+        }
+        task->y[i] = sum;
+    }
+}
+
+void spmvCompressedCSR(const CompressedCSRMatrix *A, const double *x, double *y)
+{
+    CompressedSpmvTask task = {A, x, y};
+    spmv_compressed_rows(&task, 0, A->num_rows);
+}
+
+// Same row partition and thread pinning as compressCSR used to place the rows
+double spmvCompressedCSRParallel(const CompressedCSRMatrix *A, const double *x, double *y, int passes)
+{
+    CompressedSpmvTask task = {A, x, y};
+    return for_each_partition(A->row_ptr, A->num_rows, &task, spmv_compressed_rows, passes);
+}
+
+
+// ###########################################################
+// Allocation layer for CSR arrays: huge pages, NUMA placement and first touch
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define MPOL_INTERLEAVE_MODE 3    // MPOL_INTERLEAVE from <linux/mempolicy.h>
+#define SERIAL_TOUCH_LIMIT (1 << 16) // below this many non-zeros threads cost more than they save
+#define MAX_PLACEMENT_THREADS 256
+
+static CSRPlacement csr_placement = CSR_PLACE_LOCAL;
+static CSRPageMode csr_pages = CSR_PAGES_TRANSPARENT;
+static int csr_threads = 0; // 0 means one per CPU in the affinity mask
+static int pin_warned = 0;
+
+// mmap'd arrays, so freeCSRArray knows what to munmap. Matrices hold few arrays, a list is enough
+typedef struct MappedArray {
+    void *ptr;
+    size_t len;
+    struct MappedArray *next;
+} MappedArray;
+
+static MappedArray *mapped_arrays = NULL;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void setCSRAllocation(CSRPlacement placement, CSRPageMode pages, int num_threads)
+{
+    csr_placement = placement;
+    csr_pages = pages;
+    csr_threads = num_threads;
+}
+
+// Fills cpus with the CPUs this process may run on (respects taskset, numactl and cpusets), returns how many
+static int allowed_cpus(int *cpus, int max)
+{
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+        return 0;
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mask))
+            cpus[count++] = cpu;
+    }
+    return count;
+}
+
+int csrThreadCount(void)
+{
+    if (csr_threads > 0)
+        return csr_threads < MAX_PLACEMENT_THREADS ? csr_threads : MAX_PLACEMENT_THREADS;
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+        return 1;
+    int cpus = CPU_COUNT(&mask);
+    if (cpus < 1)
+        return 1;
+    return cpus < MAX_PLACEMENT_THREADS ? cpus : MAX_PLACEMENT_THREADS;
+}
+
+// Maps len bytes (a multiple of HUGE_PAGE_SIZE) aligned to a huge page boundary, or returns NULL
+static void *map_aligned(size_t len)
+{
+    if (csr_pages == CSR_PAGES_EXPLICIT)
+    {
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+        static int warned = 0;
+        if (!warned)
+        {
+            fprintf(stderr, "Warning: no explicit huge pages available (see /proc/sys/vm/nr_hugepages), using transparent huge pages.\n");
+            warned = 1;
+        }
+    }
+
+    // Over-map by one huge page and trim, so THP can back the whole range
+    char *raw = (char *)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    munmap(aligned + len, raw + HUGE_PAGE_SIZE - aligned);
+
+    if (csr_pages != CSR_PAGES_DEFAULT)
+        madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+}
+
+// Allocates an array that will be part of a CSRMatrix; release it with freeCSRArray.
+// Memory is not touched here, pages land on the node of the thread that first writes them
+// (CSR_PLACE_LOCAL) or round-robin over all nodes (CSR_PLACE_INTERLEAVE).
+void *allocCSRArray(size_t bytes)
+{
+    if (bytes < HUGE_PAGE_SIZE)
+        return malloc(bytes > 0 ? bytes : 1); // not worth a mapping of its own
+
+    size_t len = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *p = map_aligned(len);
+    if (p == NULL)
+        return NULL;
+    MappedArray *entry = (MappedArray *)malloc(sizeof(MappedArray));
+    if (entry == NULL)
+    {
+        munmap(p, len);
+        return NULL;
+    }
+
+    if (csr_placement == CSR_PLACE_INTERLEAVE)
+    {
+        unsigned long all_nodes = ~0UL; // the kernel restricts this to the nodes we may use
+        if (syscall(SYS_mbind, p, len, MPOL_INTERLEAVE_MODE, &all_nodes, sizeof(all_nodes) * 8, 0) != 0)
+        {
+            static int warned = 0;
+            if (!warned)
+            {
+                fprintf(stderr, "Warning: mbind interleave failed, using local placement.\n");
+                warned = 1;
+            }
+        }
+    }
+
+    entry->ptr = p;
+    entry->len = len;
+    pthread_mutex_lock(&mapped_lock);
+    entry->next = mapped_arrays;
+    mapped_arrays = entry;
+    pthread_mutex_unlock(&mapped_lock);
+    return p;
+}
+
+void freeCSRArray(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&mapped_lock);
+    MappedArray **link = &mapped_arrays;
+    while (*link != NULL && (*link)->ptr != ptr)
+        link = &(*link)->next;
+    MappedArray *entry = *link;
+    if (entry != NULL)
+        *link = entry->next;
+    pthread_mutex_unlock(&mapped_lock);
+
+    if (entry != NULL)
+    {
+        munmap(entry->ptr, entry->len);
+        free(entry);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
+// Splits rows into parts of roughly equal rows + non-zeros; part t is rows [bounds[t], bounds[t+1])
+static void partitionRows(const int *row_ptr, int num_rows, int parts, int *bounds)
+{
+    long long total = (long long)row_ptr[num_rows] + num_rows;
+    bounds[0] = 0;
+    for (int t = 1; t < parts; t++)
+    {
+        long long target = total * t / parts;
+        int lo = bounds[t - 1];
+        int hi = num_rows;
+        while (lo < hi) // first row whose start weight reaches target; row_ptr[i] + i is strictly increasing
+        {
+            int mid = lo + (hi - lo) / 2;
+            if ((long long)row_ptr[mid] + mid < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        bounds[t] = lo;
+    }
+    bounds[parts] = num_rows;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// One run of work over a row partition, shared by all its threads
+typedef struct {
+    void *task;
+    void (*work)(void *task, int first_row, int last_row);
+    int passes;
+    pthread_barrier_t barrier;
+    double start; // set by thread 0 once every thread is pinned
+    double end;   // set by thread 0 after the last pass
+} PartitionRun;
+
+typedef struct {
+    PartitionRun *run;
+    int thread;
+    int cpu; // -1 when the affinity mask could not be read
+    int first_row;
+    int last_row; // exclusive
+} RowPartition;
+
+static void *run_partition(void *arg)
+{
+    RowPartition *part = (RowPartition *)arg;
+    PartitionRun *run = part->run;
+    // Thread t always runs on the t-th allowed CPU, so the thread that first touched a partition is on the node that processes it
+    if (part->cpu >= 0)
+    {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(part->cpu, &cpu);
+        int status = pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+        if (status != 0 && !__atomic_exchange_n(&pin_warned, 1, __ATOMIC_RELAXED))
+            fprintf(stderr, "Warning: could not pin thread %d to CPU %d (%s), page placement may not match.\n",
+                    part->thread, part->cpu, strerror(status));
+    }
+
+    pthread_barrier_wait(&run->barrier);
+    if (part->thread == 0)
+        run->start = monotonic_seconds();
+    for (int pass = 0; pass < run->passes; pass++)
+    {
+        run->work(run->task, part->first_row, part->last_row);
+        pthread_barrier_wait(&run->barrier); // next pass may read what this one wrote
+    }
+    if (part->thread == 0)
+        run->end = monotonic_seconds();
+    return NULL;
+}
+
+// Runs work passes times over the row partition of row_ptr with one set of pinned threads,
+// one per part. Returns the wall time of the passes, without thread start-up
+static double for_each_partition(const int *row_ptr, int num_rows, void *task, void (*work)(void *, int, int), int passes)
+{
+    int threads = csrThreadCount();
+    if (threads == 1 || (long long)row_ptr[num_rows] + num_rows < SERIAL_TOUCH_LIMIT)
+    {
+        double start = monotonic_seconds();
+        for (int pass = 0; pass < passes; pass++)
+            work(task, 0, num_rows);
+        return monotonic_seconds() - start;
+    }
+
+    int bounds[MAX_PLACEMENT_THREADS + 1];
+    int cpus[MAX_PLACEMENT_THREADS];
+    RowPartition parts[MAX_PLACEMENT_THREADS];
+    pthread_t ids[MAX_PLACEMENT_THREADS];
+    int num_cpus = allowed_cpus(cpus, MAX_PLACEMENT_THREADS);
+    partitionRows(row_ptr, num_rows, threads, bounds);
+
+    PartitionRun run;
+    run.task = task;
+    run.work = work;
+    run.passes = passes;
+    run.start = run.end = 0.0;
+    pthread_barrier_init(&run.barrier, NULL, threads);
+    for (int t = 0; t < threads; t++)
+    {
+        parts[t].run = &run;
+        parts[t].thread = t;
+        parts[t].cpu = num_cpus > 0 ? cpus[t % num_cpus] : -1;
+        parts[t].first_row = bounds[t];
+        parts[t].last_row = bounds[t + 1];
+        if (pthread_create(&ids[t], NULL, run_partition, &parts[t]) != 0)
+        {
+            fprintf(stderr, "Failed to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+    }
+    pthread_barrier_destroy(&run.barrier);
+    return run.end - run.start;
+}
+
+typedef struct {
+    CSRMatrix *matrix;
+    const int *row_ptr;
+} PlaceTask;
+
+static void touch_rows(void *arg, int first_row, int last_row)
+{
+    PlaceTask *task = (PlaceTask *)arg;
+    CSRMatrix *M = task->matrix;
+    memcpy(M->row_ptr + first_row, task->row_ptr + first_row, (last_row - first_row) * sizeof(int));
+
+    int begin = task->row_ptr[first_row];
+    int end = task->row_ptr[last_row];
+    memset(M->col_ind + begin, 0, (end - begin) * sizeof(int));
+    memset(M->csr_data + begin, 0, (end - begin) * sizeof(double));
+}
+
+// Allocates the arrays of a matrix with the given row pointers (num_rows must be set) and
+// first-touches each row partition from the thread that will process it in the parallel kernels
+void placeCSR(CSRMatrix *matrix, const int *row_ptr)
+{
+    matrix->num_non_zeros = row_ptr[matrix->num_rows];
+    matrix->row_ptr = (int *)allocCSRArray((matrix->num_rows + 1) * sizeof(int));
+    matrix->col_ind = (int *)allocCSRArray(matrix->num_non_zeros * sizeof(int));
+    matrix->csr_data = (double *)allocCSRArray(matrix->num_non_zeros * sizeof(double));
+    if (matrix->row_ptr == NULL || matrix->col_ind == NULL || matrix->csr_data == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    PlaceTask task = {matrix, row_ptr};
+    for_each_partition(row_ptr, matrix->num_rows, &task, touch_rows, 1);
+    matrix->row_ptr[matrix->num_rows] = row_ptr[matrix->num_rows];
+}
+
+CSRMatrix copyCSR(const CSRMatrix *A)
+{
+    CSRMatrix C;
+    C.num_rows = A->num_rows;
+    C.num_cols = A->num_cols;
+    placeCSR(&C, A->row_ptr);
+    memcpy(C.col_ind, A->col_ind, C.num_non_zeros * sizeof(int));
+    memcpy(C.csr_data, A->csr_data, C.num_non_zeros * sizeof(double));
+    return C;
+}
+
+typedef struct {
+    const CSRMatrix *A;
+    const double *x;
+    double *y;
+} SpmvTask;
+
+static void spmv_rows(void *arg, int first_row, int last_row)
+{
+    SpmvTask *task = (SpmvTask *)arg;
+    const CSRMatrix *A = task->A;
+    for (int i = first_row; i < last_row; i++)
+    {
+        double sum = 0.0;
+        for (int j = A->row_ptr[i]; j < A->row_ptr[i + 1]; j++)
+        {
+            sum += A->csr_data[j] * task->x[A->col_ind[j]];
+        }
+        task->y[i] = sum;
+    }
+}
+
+// Computes y = A*x passes times with one set of threads, returns the wall time of the passes.
+// Same row partition and thread pinning as placeCSR, so each thread reads the pages it touched
+double spmvCSRParallel(const CSRMatrix *A, const double *x, double *y, int passes)
+{
+    SpmvTask task = {A, x, y};
+    return for_each_partition(A->row_ptr, A->num_rows, &task, spmv_rows, passes);
+}
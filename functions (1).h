@@ -1,6 +1,8 @@
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
+#include <stddef.h>
+
 // ###########################################################
 // Do not change this part
 typedef struct {
@@ -33,4 +35,58 @@ CSRMatrix multiplyCSR(const CSRMatrix* A, const CSRMatrix* B);
 CSRMatrix transposeCSR(const CSRMatrix* A);
 void freeCSR(CSRMatrix *matrix);
 
+// Compressed CSR: each row's column indices are sorted and stored as the first
+// column (4 bytes) followed by the gaps to the next ones, all 1, 2 or 4 bytes wide
+// depending on the row's largest gap. Rows with gaps below 256 need about 1 byte
+// per index instead of 4, and decode without a branch per index.
+typedef struct {
+    double *csr_data;         // Array of non-zero values
+    unsigned char *col_bytes; // Encoded column indices
+    int *row_ptr;             // Row pointers into csr_data
+    int *byte_ptr;            // Row pointers into col_bytes
+    unsigned char *row_width; // Bytes per gap in each row: 1, 2 or 4
+    int num_non_zeros;        // Number of non-zero elements
+    int num_rows;             // Number of rows in matrix
+    int num_cols;             // Number of columns in matrix
+    int num_bytes;            // Length of col_bytes
+    int max_row_length;       // Non-zeros in the longest row
+} CompressedCSRMatrix;
+
+CompressedCSRMatrix compressCSR(const CSRMatrix *A);
+CSRMatrix decompressCSR(const CompressedCSRMatrix *A);
+void freeCompressedCSR(CompressedCSRMatrix *matrix);
+
+// Kernels on compressed input decode column indices on the fly and return a plain CSRMatrix
+CSRMatrix addCompressedCSR(const CompressedCSRMatrix *A, const CompressedCSRMatrix *B);
+CSRMatrix multiplyCompressedCSR(const CompressedCSRMatrix *A, const CompressedCSRMatrix *B);
+CSRMatrix transposeCompressedCSR(const CompressedCSRMatrix *A);
+
+// Sparse matrix-vector product y = A*x (x has num_cols entries, y has num_rows entries)
+void spmvCSR(const CSRMatrix *A, const double *x, double *y);
+void spmvCompressedCSR(const CompressedCSRMatrix *A, const double *x, double *y);
+// Same, partitioned over threads like spmvCSRParallel; returns the wall time of the passes
+double spmvCompressedCSRParallel(const CompressedCSRMatrix *A, const double *x, double *y, int passes);
+
+// Allocation of row_ptr, col_ind and csr_data. Every CSRMatrix returned by the functions
+// above uses these, so freeCSR releases them with freeCSRArray.
+typedef enum {
+    CSR_PLACE_LOCAL,     // pages on the NUMA node of the thread that first touches them
+    CSR_PLACE_INTERLEAVE // pages round-robin over all NUMA nodes
+} CSRPlacement;
+
+typedef enum {
+    CSR_PAGES_DEFAULT,     // regular 4 KB pages
+    CSR_PAGES_TRANSPARENT, // madvise(MADV_HUGEPAGE), the kernel backs arrays with 2 MB pages when it can
+    CSR_PAGES_EXPLICIT     // MAP_HUGETLB from the reserved pool, falls back to transparent if empty
+} CSRPageMode;
+
+// num_threads 0 uses one thread per CPU the process may run on. Defaults: CSR_PLACE_LOCAL, CSR_PAGES_TRANSPARENT, 0
+void setCSRAllocation(CSRPlacement placement, CSRPageMode pages, int num_threads);
+int csrThreadCount(void);
+void *allocCSRArray(size_t bytes);
+void freeCSRArray(void *ptr);
+void placeCSR(CSRMatrix *matrix, const int *row_ptr);
+CSRMatrix copyCSR(const CSRMatrix *A);
+double spmvCSRParallel(const CSRMatrix *A, const double *x, double *y, int passes);
+
 #endif
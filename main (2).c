@@ -3,6 +3,310 @@
 #include "functions.h"
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
+
+#define SPMV_REPEATS 50
+
+static double wall_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static double seconds_since(clock_t start)
+{
+    return ((double)(clock() - start)) / CLOCKS_PER_SEC;
+}
+
+typedef struct {
+    int col;
+    double value;
+} RowEntry;
+
+static int compare_row_entries(const void *a, const void *b)
+{
+    int col_a = ((const RowEntry *)a)->col;
+    int col_b = ((const RowEntry *)b)->col;
+    if (col_a != col_b)
+        return (col_a > col_b) - (col_a < col_b);
+    double value_a = ((const RowEntry *)a)->value; // duplicate columns in a row, order by value
+    double value_b = ((const RowEntry *)b)->value;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+static int close_enough(double a, double b)
+{
+    return fabs(a - b) <= 1e-9 * (1.0 + fabs(a));
+}
+
+// Compares X and Y as matrices: entries within a row may be in any order, values within a tolerance
+static int same_matrix(const CSRMatrix *X, const CSRMatrix *Y)
+{
+    if (X->num_rows != Y->num_rows || X->num_cols != Y->num_cols || X->num_non_zeros != Y->num_non_zeros ||
+        memcmp(X->row_ptr, Y->row_ptr, (X->num_rows + 1) * sizeof(int)) != 0)
+        return 0;
+
+    int longest_row = 1;
+    for (int i = 0; i < X->num_rows; i++)
+    {
+        if (X->row_ptr[i + 1] - X->row_ptr[i] > longest_row)
+            longest_row = X->row_ptr[i + 1] - X->row_ptr[i];
+    }
+    RowEntry *x_row = (RowEntry *)malloc(longest_row * sizeof(RowEntry));
+    RowEntry *y_row = (RowEntry *)malloc(longest_row * sizeof(RowEntry));
+    if (x_row == NULL || y_row == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int same = 1;
+    for (int i = 0; i < X->num_rows && same; i++)
+    {
+        int start = X->row_ptr[i];
+        int length = X->row_ptr[i + 1] - start;
+        for (int k = 0; k < length; k++)
+        {
+            x_row[k].col = X->col_ind[start + k];
+            x_row[k].value = X->csr_data[start + k];
+            y_row[k].col = Y->col_ind[start + k];
+            y_row[k].value = Y->csr_data[start + k];
+        }
+        qsort(x_row, length, sizeof(RowEntry), compare_row_entries);
+        qsort(y_row, length, sizeof(RowEntry), compare_row_entries);
+        for (int k = 0; k < length && same; k++)
+        {
+            same = x_row[k].col == y_row[k].col && close_enough(x_row[k].value, y_row[k].value);
+        }
+    }
+
+    free(x_row);
+    free(y_row);
+    return same;
+}
+
+// Compares the kernels on A against their compressed-index counterparts
+static void benchmark_compressed(const CSRMatrix *A, int print)
+{
+    double wall_start = wall_seconds();
+    CompressedCSRMatrix Z = compressCSR(A);
+    double encode_time = wall_seconds() - wall_start;
+
+    long long plain_bytes = (long long)A->num_non_zeros * sizeof(int);
+    long long packed_bytes = Z.num_bytes + (long long)(Z.num_rows + 1) * sizeof(int) + Z.num_rows; // + byte_ptr and row_width
+    long long total_bytes = plain_bytes + (long long)A->num_non_zeros * sizeof(double) + (long long)(A->num_rows + 1) * sizeof(int);
+    printf("Column indices: %lld bytes plain, %lld bytes compressed (%.2f bytes/index)\n",
+           plain_bytes, packed_bytes, A->num_non_zeros ? (double)Z.num_bytes / A->num_non_zeros : 0.0);
+    printf("Matrix memory saved: %lld of %lld bytes (%.1f%%)\n", plain_bytes - packed_bytes, total_bytes,
+           total_bytes ? 100.0 * (plain_bytes - packed_bytes) / total_bytes : 0.0);
+    printf("Encode time: %f seconds\n", encode_time);
+
+    double *x = (double *)allocCSRArray(A->num_cols * sizeof(double));
+    double *y_plain = (double *)allocCSRArray(A->num_rows * sizeof(double));
+    double *y_packed = (double *)allocCSRArray(A->num_rows * sizeof(double));
+    if (x == NULL || y_plain == NULL || y_packed == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < A->num_cols; i++)
+    {
+        x[i] = 1.0 + (i % 7);
+    }
+
+    // Parallel so the plain kernel is bandwidth bound; only then can fewer index bytes pay off
+    spmvCSRParallel(A, x, y_plain, 1); // warm up: first touch of y, page faults
+    spmvCompressedCSRParallel(&Z, x, y_packed, 1);
+    double plain_time = spmvCSRParallel(A, x, y_plain, SPMV_REPEATS);
+    double packed_time = spmvCompressedCSRParallel(&Z, x, y_packed, SPMV_REPEATS);
+    double vectors = (double)A->num_cols * sizeof(double) + (double)A->num_rows * sizeof(double);
+    double plain_traffic = (double)A->num_non_zeros * (sizeof(double) + sizeof(int)) + (A->num_rows + 1.0) * sizeof(int) + vectors;
+    double packed_traffic = (double)A->num_non_zeros * sizeof(double) + (double)packed_bytes + (A->num_rows + 1.0) * sizeof(int) + vectors;
+    int same = 1; // compressCSR reorders entries within each row, so sums may differ in the last bits
+    for (int i = 0; i < A->num_rows; i++)
+    {
+        if (!close_enough(y_plain[i], y_packed[i]))
+            same = 0;
+    }
+    printf("spmv (x%d, %d threads):  plain %f s (%.2f GB/s), compressed %f s (%.2f GB/s)%s\n", SPMV_REPEATS, csrThreadCount(),
+           plain_time, plain_time > 0 ? plain_traffic * SPMV_REPEATS / plain_time * 1e-9 : 0.0,
+           packed_time, packed_time > 0 ? packed_traffic * SPMV_REPEATS / packed_time * 1e-9 : 0.0, same ? "" : "  MISMATCH");
+
+    clock_t start;
+
+    start = clock();
+    CSRMatrix T_plain = transposeCSR(A);
+    plain_time = seconds_since(start);
+    start = clock();
+    CSRMatrix T_packed = transposeCompressedCSR(&Z);
+    packed_time = seconds_since(start);
+    same = same_matrix(&T_plain, &T_packed);
+    printf("transpose:  plain %f s, compressed %f s%s\n", plain_time, packed_time, same ? "" : "  MISMATCH");
+
+    start = clock();
+    CSRMatrix S_plain = addCSR(A, A);
+    plain_time = seconds_since(start);
+    start = clock();
+    CSRMatrix S_packed = addCompressedCSR(&Z, &Z);
+    packed_time = seconds_since(start);
+    same = same_matrix(&S_plain, &S_packed);
+    printf("addition:   plain %f s, compressed %f s%s\n", plain_time, packed_time, same ? "" : "  MISMATCH");
+
+    if (A->num_rows == A->num_cols)
+    {
+        start = clock();
+        CSRMatrix P_plain = multiplyCSR(A, A);
+        plain_time = seconds_since(start);
+        start = clock();
+        CSRMatrix P_packed = multiplyCompressedCSR(&Z, &Z);
+        packed_time = seconds_since(start);
+        same = same_matrix(&P_plain, &P_packed);
+        printf("multiply:   plain %f s, compressed %f s%s\n", plain_time, packed_time, same ? "" : "  MISMATCH");
+        if (print)
+        {
+            printf("A*A from compressed input:\n");
+            print_CSR_Matrix(&P_packed);
+        }
+        freeCSR(&P_plain);
+        freeCSR(&P_packed);
+    }
+
+    if (print)
+    {
+        printf("A^T from compressed input:\n");
+        print_CSR_Matrix(&T_packed);
+        printf("A+A from compressed input:\n");
+        print_CSR_Matrix(&S_packed);
+    }
+
+    freeCSR(&T_plain);
+    freeCSR(&T_packed);
+    freeCSR(&S_plain);
+    freeCSR(&S_packed);
+    freeCSRArray(x);
+    freeCSRArray(y_plain);
+    freeCSRArray(y_packed);
+    freeCompressedCSR(&Z);
+}
+
+static CSRPageMode page_mode = CSR_PAGES_TRANSPARENT;
+static CSRPlacement placement = CSR_PLACE_LOCAL;
+static int num_threads = 0;
+
+// CSR_PLACEMENT=local|interleave, CSR_HUGEPAGES=off|thp|explicit, CSR_THREADS=<n>.
+// Returns 0 if a variable has a value we do not understand, so a run never measures the wrong setup
+static int configure_allocation(void)
+{
+    const char *value = getenv("CSR_PLACEMENT");
+    if (value != NULL)
+    {
+        if (strcmp(value, "local") == 0)
+            placement = CSR_PLACE_LOCAL;
+        else if (strcmp(value, "interleave") == 0)
+            placement = CSR_PLACE_INTERLEAVE;
+        else
+        {
+            fprintf(stderr, "Invalid CSR_PLACEMENT=%s, use local or interleave.\n", value);
+            return 0;
+        }
+    }
+
+    value = getenv("CSR_HUGEPAGES");
+    if (value != NULL)
+    {
+        if (strcmp(value, "off") == 0)
+            page_mode = CSR_PAGES_DEFAULT;
+        else if (strcmp(value, "thp") == 0)
+            page_mode = CSR_PAGES_TRANSPARENT;
+        else if (strcmp(value, "explicit") == 0)
+            page_mode = CSR_PAGES_EXPLICIT;
+        else
+        {
+            fprintf(stderr, "Invalid CSR_HUGEPAGES=%s, use off, thp or explicit.\n", value);
+            return 0;
+        }
+    }
+
+    value = getenv("CSR_THREADS");
+    if (value != NULL)
+    {
+        char *end;
+        long threads = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || threads < 0 || threads > INT_MAX)
+        {
+            fprintf(stderr, "Invalid CSR_THREADS=%s, use a number >= 0 (0 = one per allowed CPU).\n", value);
+            return 0;
+        }
+        num_threads = (int)threads;
+    }
+
+    setCSRAllocation(placement, page_mode, num_threads);
+    return 1;
+}
+
+// Runs the parallel spmv on copies of A placed locally (first touch) and interleaved across nodes
+static void benchmark_placement(const CSRMatrix *A, int print)
+{
+    const char *names[] = {"local", "interleave"};
+    CSRPlacement placements[] = {CSR_PLACE_LOCAL, CSR_PLACE_INTERLEAVE};
+    double *results[2];
+    double bytes = (double)A->num_non_zeros * (sizeof(double) + sizeof(int)) +
+                   (double)A->num_rows * (sizeof(int) + sizeof(double)) + (double)A->num_cols * sizeof(double);
+    printf("Threads: %d, huge pages: %s\n", csrThreadCount(),
+           page_mode == CSR_PAGES_DEFAULT ? "off" : page_mode == CSR_PAGES_EXPLICIT ? "explicit" : "transparent");
+
+    // Every thread gathers from all of x, so it is interleaved and shared by both runs;
+    // only the placement of the matrix and of y differs between them
+    setCSRAllocation(CSR_PLACE_INTERLEAVE, page_mode, num_threads);
+    double *x = (double *)allocCSRArray(A->num_cols * sizeof(double));
+    if (x == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < A->num_cols; i++)
+    {
+        x[i] = 1.0 + (i % 7);
+    }
+
+    for (int p = 0; p < 2; p++)
+    {
+        setCSRAllocation(placements[p], page_mode, num_threads);
+        double start = wall_seconds();
+        CSRMatrix P = copyCSR(A);
+        double place_time = wall_seconds() - start;
+
+        results[p] = (double *)allocCSRArray(A->num_rows * sizeof(double));
+        if (results[p] == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        spmvCSRParallel(&P, x, results[p], 1); // warm up: first touch of y, page faults
+        double spmv_time = spmvCSRParallel(&P, x, results[p], SPMV_REPEATS); // times the passes only, not thread start-up
+
+        printf("%-10s placement %f s, spmv (x%d) %f s, %.2f GB/s\n", names[p], place_time, SPMV_REPEATS, spmv_time,
+               spmv_time > 0 ? bytes * SPMV_REPEATS / spmv_time * 1e-9 : 0.0);
+        freeCSR(&P);
+    }
+    freeCSRArray(x);
+
+    if (memcmp(results[0], results[1], A->num_rows * sizeof(double)) != 0)
+        printf("MISMATCH between local and interleaved results\n");
+    if (print)
+    {
+        printf("y = A*x: ");
+        for (int i = 0; i < A->num_rows; i++)
+            printf("%.6f ", results[0][i]);
+        printf("\n");
+    }
+    freeCSRArray(results[0]);
+    freeCSRArray(results[1]);
+    setCSRAllocation(placement, page_mode, num_threads);
+}
 
 int main(int argc, char *argv[])
 {
@@ -20,8 +324,16 @@ int main(int argc, char *argv[])
     const char *filename = argv[1];
     printf("Trying to open file: %s\n", filename);
 
+    if (!configure_allocation())
+    {
+        return 1;
+    }
     CSRMatrix A;
     ReadMMtoCSR(filename, &A);
+    if (A.row_ptr == NULL) // ReadMMtoCSR already reported why
+    {
+        return 1;
+    }
 
     if (argc == 2)
     {
@@ -52,9 +364,34 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    else if (argc == 4 && (strcmp(argv[2], "compress") == 0))
+    {
+        benchmark_compressed(&A, atoi(argv[3]) == 1);
+        freeCSR(&A);
+        end_time = clock();
+        cpu_time_used = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+        printf("CPU time: %f seconds\n", cpu_time_used);
+        return 0;
+    }
+
+    else if (argc == 4 && (strcmp(argv[2], "numa") == 0))
+    {
+        benchmark_placement(&A, atoi(argv[3]) == 1);
+        freeCSR(&A);
+        end_time = clock();
+        cpu_time_used = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+        printf("CPU time: %f seconds\n", cpu_time_used);
+        return 0;
+    }
+
     const char *filename_2 = argv[2];
     CSRMatrix B;
     ReadMMtoCSR(filename_2, &B);
+    if (B.row_ptr == NULL)
+    {
+        freeCSR(&A);
+        return 1;
+    }
     CSRMatrix C;
     const char *calc = argv[3];
 
@@ -74,7 +411,7 @@ int main(int argc, char *argv[])
         }
         else
         {
-            fprintf(stderr, "Please use one of the following when calculating: addition, subtract, multiply or transpose. \n");
+            fprintf(stderr, "Please use one of the following when calculating: addition, subtract, multiply, transpose, compress or numa. \n");
             freeCSR(&A);
             freeCSR(&B);
             end_time = clock();